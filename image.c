@@ -5,6 +5,12 @@
 #include <string.h>
 #include <errno.h>
 #include <math.h>
+#include <stdint.h>
+
+//M_PI is a POSIX extension, not ISO C
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
 
 //structs
 typedef struct Pair {
@@ -12,31 +18,98 @@ typedef struct Pair {
     unsigned int y;
 } Pair;
 
+typedef struct PBMSinkState {
+    FILE *fout;
+    unsigned int numBytesPerRow;
+} PBMSinkState;
+
+typedef struct PlainPBMSinkState {
+    FILE *fout;
+    unsigned int width;
+    unsigned int numBytesPerRow;
+} PlainPBMSinkState;
+
+typedef struct LineFit {
+    size_t n;
+    double meanX;
+    double meanY;
+    double sumSquaresX;
+    double sumSquaresY;
+    double sumProducts;
+} LineFit;
+
+typedef struct MarginSamples {
+    Pair *points;
+    char *inliers;
+    size_t numPoints;
+    size_t numInliers;
+    int *firstBlack;
+    char *rowStatus;
+    LineFit fit;
+    double scale;
+} MarginSamples;
+
 //constants
 static unsigned int MARGIN_SIZE = 10;
 static int NUM_DILATIONS = 8;
+static unsigned int INITIAL_MARGIN_SAMPLES = 32;
+static double ANGLE_TOLERANCE = 0.0005;
+static double MIN_OUTLIER_DISTANCE = 1.0;
+static double MAX_MARGIN_SCALE = 3.0;
+static int ROBUST_FIT_ITERATIONS = 4;
+static unsigned int ROTATE_BAND_ROWS = 64;
+
+//a define rather than a static so the plain PBM writer can size its line buffer with it
+#define PLAIN_PIXELS_PER_LINE 64
+
+//the plain PBM encode/decode packs eight ASCII digits at a time in a 64 bit word, which assumes little endian byte order
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define PLAIN_PBM_SWAR 1
+#else
+#define PLAIN_PBM_SWAR 0
+#endif
 
 //image processing methods
 static void findSeamRange(Image *self, unsigned int rowNum, unsigned int *seamStart, unsigned int *seamEnd);
 static void clearMargins(Image *self, unsigned int width);
-static void dilate(Image *self);
-static double findRotationAngle(Image *self);
+static void findCropBounds(Image *self, unsigned int *leftCrop, unsigned int *rightCrop);
+static double findRotationAngle(Image *self, PageInfo *info);
+static int findMarginX(Image *self, unsigned int rowNum, int *firstBlack);
+static int sampleMarginRow(Image *self, unsigned int rowNum, MarginSamples *samples);
+static void refitMargin(MarginSamples *samples);
 static void rotate(Image *self, double theta);
+static void rotateRow(Image *self, double theta, unsigned int rowNum, char *row);
 
 //image access methods
 static int get(Image *self, unsigned int x, unsigned int y);
 static int set(Image *self, unsigned int x, unsigned int y, int val);
 static void printBox(Image *self, unsigned int x, unsigned int y, unsigned int width, unsigned int height);
 static Image *copyBox(Image *self, unsigned int x, unsigned int y, unsigned int width, unsigned int height);
-static Image *copy(Image *self);
 static int getSample(Image *self, double x, double y);
+static int firstBlackPixel(Image *self, unsigned int rowNum, unsigned int limit);
 
 //utility methods
 static int skipWhitespace(char *str, size_t start);
-static int fitLineToPoints(Pair *points, size_t numPoints, double *mInvResult, double *bResult);
-static size_t removeXOutliers(Pair *points, size_t len);
+static int decodePlainRaster(const char *src, size_t length, Image *dest);
+static void encodePlainByte(unsigned char byte, char *dest);
+static uint64_t matchingBytes(uint64_t word, unsigned char value);
+static void addPointToFit(LineFit *fit, double x, double y);
+static void lineFromFit(LineFit *fit, double *mInvResult, double *bResult);
+static double residualScaleFromFit(LineFit *fit);
+static double angleErrorFromFit(LineFit *fit);
+static size_t fitLineRobust(Pair *points, size_t numPoints, char *inliers, LineFit *fitResult, double *scaleResult);
+static double median(double *values, size_t len);
+static int compareDoubles(const void *a, const void *b);
 static void shiftDataLeft(char *data, unsigned int height, unsigned int numBytesPerRow, int numShifts);
 
+//output methods
+static int writePBMHeader(RowSink *self, unsigned int width, unsigned int height, unsigned int numBytesPerRow);
+static int writePBMRows(RowSink *self, const char *rows, unsigned int numRows);
+static int finishPBM(RowSink *self);
+static int writePlainPBMHeader(RowSink *self, unsigned int width, unsigned int height, unsigned int numBytesPerRow);
+static int writePlainPBMRows(RowSink *self, const char *rows, unsigned int numRows);
+static int saveWithSink(const char *filename, Image *self, double theta, int rotated, int plain);
+
 
 Image *createImage(char *pbmContents, size_t length){
     size_t c, start;
@@ -44,29 +117,30 @@ Image *createImage(char *pbmContents, size_t length){
     char buffer[80];
 
     //parse the header
-    //first, read the magic characters - P4
+    //first, read the magic characters - P4 for binary or P1 for plain
     c = skipWhitespace(pbmContents, 0);
     start = c;
-    while (!isspace(pbmContents[c])){
+    while (!isspace(pbmContents[c]) && pbmContents[c] != '#' && pbmContents[c] != '\0'){
         if ((c - start) == 79){
-            printf("Bad header\n");
+            fprintf(stderr, "Bad header\n");
             return NULL;
         }
         buffer[c - start] = pbmContents[c];
         c++;
     }
     buffer[c - start] = '\0';
-    if (strcmp(buffer, "P4")){
-        printf("Wrong magic\n");
+    int plain = !strcmp(buffer, "P1");
+    if (!plain && strcmp(buffer, "P4")){
+        fprintf(stderr, "Wrong magic\n");
         return NULL;
     }
 
     //read the width
     c = skipWhitespace(pbmContents, c);
     start = c;
-    while (!isspace(pbmContents[c])){
+    while (!isspace(pbmContents[c]) && pbmContents[c] != '#' && pbmContents[c] != '\0'){
         if ((c - start) == 79){
-            printf("Bad header\n");
+            fprintf(stderr, "Bad header\n");
             return NULL;
         }
         buffer[c - start] = pbmContents[c];
@@ -75,7 +149,7 @@ Image *createImage(char *pbmContents, size_t length){
     buffer[c - start] = '\0';
     width = strtol(buffer, NULL, 10);
     if (errno == ERANGE){
-        printf("Unable to parse width\n");
+        fprintf(stderr, "Unable to parse width\n");
         errno = 0;
         return NULL;
     }
@@ -83,9 +157,9 @@ Image *createImage(char *pbmContents, size_t length){
     //read the height
     c = skipWhitespace(pbmContents, c);
     start = c;
-    while (!isspace(pbmContents[c])){
+    while (!isspace(pbmContents[c]) && pbmContents[c] != '#' && pbmContents[c] != '\0'){
         if ((c - start) == 79){
-            printf("Bad header\n");
+            fprintf(stderr, "Bad header\n");
             return NULL;
         }
         buffer[c - start] = pbmContents[c];
@@ -94,27 +168,35 @@ Image *createImage(char *pbmContents, size_t length){
     buffer[c - start] = '\0';
     height = strtol(buffer, NULL, 10);
     if (errno == ERANGE){
-        printf("Unable to parse height\n");
+        fprintf(stderr, "Unable to parse height\n");
         errno = 0;
         return NULL;
     }
 
-    //the next character is whitespace, and then we read the whole file to the end
+    //allocate the struct
+    Image *result = malloc(sizeof(Image));
+    result->width = width;
+    result->height = height;
+    result->numBytesPerRow = (width / 8) + ((width % 8) != 0);
+
+    //plain files have ASCII digits to pack into bits
+    if (plain){
+        result->data = calloc(height * result->numBytesPerRow, sizeof(char));
+        if (!decodePlainRaster(pbmContents + c, length - c, result)){
+            free(result->data);
+            free(result);
+            return NULL;
+        }
+        return result;
+    }
+
+    //for binary files the next character is whitespace, and then we read the whole file to the end
     c++;
-    start = c;
-    unsigned int numBytesPerRow = (width / 8) + ((width % 8) != 0);
-    char *contents = malloc(sizeof(char) * height * numBytesPerRow);
+    result->data = malloc(sizeof(char) * height * result->numBytesPerRow);
 //    for (c; c < length; c++){
 //        contents[c - start] = pbmContents[c];
 //    }
-    memcpy(contents, pbmContents+c, numBytesPerRow * height);
-
-    //finally, allocate and fill the struct
-    Image *result = malloc(sizeof(Image));
-    result->width = width;
-    result->height = height;
-    result->numBytesPerRow = numBytesPerRow;
-    result->data = contents;
+    memcpy(result->data, pbmContents+c, result->numBytesPerRow * height);
 
     return result;
 }
@@ -134,43 +216,77 @@ int correctImage(Image *self, Image **lResult, Image **rResult){
     //determine rotation angle
     //rotate
 
-    Image *left, *right, *leftBloat, *rightBloat;
-    unsigned int leftCrop, rightCrop;
+    Image *left, *right;
+    PageInfo lInfo, rInfo;
+
+    //split and measure the pages, then rotate them
+    splitImage(self, &left, &right, &lInfo, &rInfo);
+    rotate(left, lInfo.angle);
+    rotate(right, rInfo.angle);
+
+    //store results
+    *lResult = left;
+    *rResult = right;
+    return 0;
+}
+
+//does everything correctImage does except rotate, storing the crop and angle measurements for each page
+//the split pages are thrown away, so this is much cheaper than correcting when only the numbers are needed
+//return value is meaningless
+int analyzeImage(Image *self, PageInfo *lResult, PageInfo *rResult){
+    Image *left, *right;
+
+    splitImage(self, &left, &right, lResult, rResult);
+
+    free(left->data);
+    free(right->data);
+    free(left);
+    free(right);
+    return 0;
+}
+
+//go row by row and dumbly choose where we think the seam starts/stops so that we know where to crop
+void findCropBounds(Image *self, unsigned int *leftCrop, unsigned int *rightCrop){
     unsigned int seamStart, seamEnd;
-    size_t i,j;
+    size_t j;
 
-    //go row by row and dumbly choose where we think the seam starts/stops
-    //so that we know hwere to crop
-    leftCrop = -1;
-    rightCrop = 0;
+    *leftCrop = -1;
+    *rightCrop = 0;
     for (j = 0; j < self->height; j++){
         findSeamRange(self, j, &seamStart, &seamEnd);
         if (seamStart != -1 && seamEnd != -1){
-            if (seamStart < leftCrop){
-                leftCrop = seamStart;
+            if (seamStart < *leftCrop){
+                *leftCrop = seamStart;
             }
-            if (seamEnd > rightCrop){
-                rightCrop = seamEnd;
+            if (seamEnd > *rightCrop){
+                *rightCrop = seamEnd;
             }
         }
     }
-    left = copyBox(self, 0, 0, leftCrop + 1, self->height);
-    right = copyBox(self, rightCrop, 0, self->width - rightCrop - 1, self->height);
+}
 
-    //clear margins - 10 pixels on each side - pizza hardcoded
-    clearMargins(left, MARGIN_SIZE);
-    clearMargins(right, MARGIN_SIZE);
+//split the image at the seam, clear the margins of each page, and find their rotation angles without rotating
+//the pages are stored in lResult and rResult, and their measurements in lInfo and rInfo
+//return value is meaningless
+int splitImage(Image *self, Image **lResult, Image **rResult, PageInfo *lInfo, PageInfo *rInfo){
+    unsigned int leftCrop, rightCrop;
 
-    //rotate the split images
-    double rotationAngle;
-    rotationAngle = findRotationAngle(left);
-    rotate(left, rotationAngle);
-    rotationAngle = findRotationAngle(right);
-    rotate(right, rotationAngle);
+    //crop on either side of the seam
+    findCropBounds(self, &leftCrop, &rightCrop);
+    lInfo->cropX = 0;
+    lInfo->cropWidth = leftCrop + 1;
+    rInfo->cropX = rightCrop;
+    rInfo->cropWidth = self->width - rightCrop - 1;
+    *lResult = copyBox(self, lInfo->cropX, 0, lInfo->cropWidth, self->height);
+    *rResult = copyBox(self, rInfo->cropX, 0, rInfo->cropWidth, self->height);
 
-    //store results
-    *lResult = left;
-    *rResult = right;
+    //clear margins - 10 pixels on each side - pizza hardcoded
+    clearMargins(*lResult, MARGIN_SIZE);
+    clearMargins(*rResult, MARGIN_SIZE);
+
+    //measure how far off each page is
+    findRotationAngle(*lResult, lInfo);
+    findRotationAngle(*rResult, rInfo);
     return 0;
 }
 
@@ -270,125 +386,297 @@ void clearMargins(Image *self, unsigned int width){
     }
 }
 
-//dilate and image NUM_DILATION times - union of original, left shift, and up and down left diagonal shifts
-void dilate(Image *self){
-    char *centerPixels = malloc(sizeof(char) * self->numBytesPerRow * self->height);
-    char *upPixels = malloc(sizeof(char) * self->numBytesPerRow * self->height);
-    char *downPixels = malloc(sizeof(char) * self->numBytesPerRow * self->height);
-    size_t count, i;
-
-    for (count = 0; count < NUM_DILATIONS; count++){
-        //create copy of image, copy shifted up, and copy shifted down - probably could streamline this
-        memcpy(centerPixels, self->data, self->numBytesPerRow * self->height);
-        memcpy(upPixels, self->data + self->numBytesPerRow, (self->numBytesPerRow - 1) * self->height);
-        memcpy(downPixels + self->numBytesPerRow, self->data, (self->numBytesPerRow - 1) * self->height);
-
-        //shift the copies left
-        shiftDataLeft(centerPixels, self->height, self->numBytesPerRow, 1);
-        shiftDataLeft(upPixels, self->height, self->numBytesPerRow, 1);
-        shiftDataLeft(downPixels, self->height, self->numBytesPerRow, 1);
+//determine the angle to rotate the image so that the margin is straight
+//the margin is sampled sparsely at first, and more rows are only looked at where the fit is poor, until the angle is
+//known to within ANGLE_TOLERANCE or the sampling can't get any finer
+//the angle, its error, and the margin point counts are also stored in info
+double findRotationAngle(Image *self, PageInfo *info){
+    size_t j;
+    unsigned int stride, numAdded, numRejected;
+    double mInv, b;
+    MarginSamples samples;
+
+    //an empty page, like when no seam is found, has no margin to measure - leave it unrotated
+    if (self->width == 0 || self->height == 0){
+        info->numSampledRows = 0;
+        info->numMarginPoints = 0;
+        info->numInlierPoints = 0;
+        info->marginScale = 0;
+        info->angleError = M_PI / 2;
+        info->angle = 0;
+        return 0;
+    }
 
-        //propagate the changes to the original
-        for (i = 0; i < self->height * self->numBytesPerRow; i++){
-            self->data[i] |= centerPixels[i];
-            self->data[i] |= upPixels[i];
-            self->data[i] |= downPixels[i];
-        }
+    //firstBlack caches the first black pixel of each row since neighboring samples share rows, -2 means not yet found
+    //rowStatus is 0 for rows not sampled, 1 for rows that fit well, and 2 for rows that need a closer look
+    samples.points = malloc(sizeof(Pair) * self->height);
+    samples.inliers = malloc(sizeof(char) * self->height);
+    samples.numPoints = 0;
+    samples.numInliers = 0;
+    samples.firstBlack = malloc(sizeof(int) * self->height);
+    samples.rowStatus = calloc(self->height, sizeof(char));
+    memset(&samples.fit, 0, sizeof(LineFit));
+    samples.scale = 0;
+    for (j = 0; j < self->height; j++){
+        samples.firstBlack[j] = -2;
     }
 
-    free(centerPixels);
-    free(upPixels);
-    free(downPixels);
-}
+    //start with evenly spaced rows - the stride is a power of two so halving it keeps the old rows on the grid
+    stride = 1;
+    while (stride * INITIAL_MARGIN_SAMPLES < self->height){
+        stride *= 2;
+    }
+    info->numSampledRows = 0;
+    for (j = 0; j < self->height; j += stride){
+        sampleMarginRow(self, j, &samples);
+        info->numSampledRows++;
+    }
 
-//determine the angle to rotate the image so that the margin is straight
-double findRotationAngle(Image *self){
-    size_t i, j;
-    Image *dilatedSelf = copy(self);
-    dilate(dilatedSelf);
+    //fit a line in terms of y to those rows, ignoring outliers - this seeds the running fit that later rows are added to
+    refitMargin(&samples);
+
+    while (angleErrorFromFit(&samples.fit) > ANGLE_TOLERANCE && stride > 1){
+        //sample halfway between the grid rows around each marked row
+        stride /= 2;
+        numAdded = 0;
+        numRejected = 0;
+        for (j = stride; j < self->height; j += 2 * stride){
+            if (samples.rowStatus[j - stride] == 2 || (j + stride < self->height && samples.rowStatus[j + stride] == 2)){
+                numRejected += !sampleMarginRow(self, j, &samples);
+                numAdded++;
+            }
+        }
 
-    //find the equation for a line that matches up to the margin
-    Pair *marginPoints = malloc(sizeof(Pair) * self->height);
-    size_t numMarginPoints = 0;
-    double mInv, b;
-    for (j = 0; j < self->height; j++){
-        for (i = 0; i < self->width / 4; i++){
-            if (get(dilatedSelf, i, j)){
-                marginPoints[numMarginPoints].x = i;
-                marginPoints[numMarginPoints].y = j;
-                numMarginPoints++;
-                break;
+        //if nothing stood out the margin is just noisy everywhere, so sample everywhere
+        if (numAdded == 0){
+            for (j = stride; j < self->height; j += 2 * stride){
+                numRejected += !sampleMarginRow(self, j, &samples);
+                numAdded++;
             }
         }
+        info->numSampledRows += numAdded;
+
+        //the running fit only stays trustworthy if the line it was checked against was - if the last robust fit was
+        //loose, many new rows were turned away, or the accepted rows spread out well past the robust scale, start over
+        if (samples.scale > MAX_MARGIN_SCALE || numRejected * 4 > numAdded
+                || residualScaleFromFit(&samples.fit) > 2 * fmax(samples.scale, MIN_OUTLIER_DISTANCE)){
+            refitMargin(&samples);
+        }
     }
-    
-    //remove outliers and fit a line in terms of y to the margin
-    numMarginPoints = removeXOutliers(marginPoints, numMarginPoints);
-    fitLineToPoints(marginPoints, numMarginPoints, &mInv, &b);
+    lineFromFit(&samples.fit, &mInv, &b);
+    info->angleError = angleErrorFromFit(&samples.fit);
+    info->numMarginPoints = samples.numPoints;
+    info->numInlierPoints = samples.numInliers;
+    info->marginScale = samples.scale;
 
     //no need for these anymore
-    free(marginPoints);
-    free(dilatedSelf->data);
-    free(dilatedSelf);
+    free(samples.points);
+    free(samples.inliers);
+    free(samples.firstBlack);
+    free(samples.rowStatus);
 
     //if you were reasonably confident about how bad rotation could be you could just assign these without searching
-    //doubles because Pair uses unsigned ints
-    double x1, x2, y1, y2;
-    for (j = 0; j < self->height; j++){
-        x1 = (mInv * j) + b;
+    //doubles because Pair uses unsigned ints; the row is signed so the search up from the bottom can end
+    long row;
+    double x1 = 0;
+    double x2 = 0;
+    double y1 = -1;
+    double y2 = -1;
+    for (row = 0; row < self->height; row++){
+        x1 = (mInv * row) + b;
         if (0 <= x1 && x1 < self->width){
-            y1 = j;
+            y1 = row;
             break;
         }
     }
-    for (j = self->height - 1; j >= 0; j--){
-        x2 = (mInv * j) + b;
+    for (row = (long)self->height - 1; row >= 0; row--){
+        x2 = (mInv * row) + b;
         if (0 <= x2 && x2 < self->width){
-            y2 = j;
+            y2 = row;
             break;
         }
     }
+
+    //if there was no margin to fit, or the line never crosses the page, there's nothing to go on, so leave it unrotated
+    if (info->numInlierPoints < 2 || y1 < 0 || y2 <= y1){
+        info->angle = 0;
+        return 0;
+    }
     double angle = atan(fabs(x1 - x2) / fabs(y1 - y2));
     if (mInv < 0){
         angle = -1 * angle;
     }
+    info->angle = angle;
     return angle;
 }
 
+//look at a row of the margin and store its margin point, if it has one
+//once there is a robust fit, the point is checked against the current line and added to the running fit if it is
+//within 3 times the MAD scale of the last robust fit, the same multiple fitLineRobust uses around its median residual
+//the row is marked in rowStatus as needing a closer look if its point is an outlier or far from the line
+//returns 0 if the point was turned away as an outlier, 1 otherwise
+int sampleMarginRow(Image *self, unsigned int rowNum, MarginSamples *samples){
+    double mInv, b, cutoff, residual;
+    int marginX = findMarginX(self, rowNum, samples->firstBlack);
+
+    samples->rowStatus[rowNum] = 1;
+    if (marginX < 0){
+        return 1;
+    }
+    samples->points[samples->numPoints].x = marginX;
+    samples->points[samples->numPoints].y = rowNum;
+    samples->inliers[samples->numPoints] = 0;
+    samples->numPoints++;
+
+    //until there are enough points for a line with a spread, take everything - refitMargin sorts it out
+    if (samples->fit.n < 3){
+        samples->inliers[samples->numPoints - 1] = 1;
+        addPointToFit(&samples->fit, marginX, rowNum);
+        samples->numInliers++;
+        samples->rowStatus[rowNum] = 2;
+        return 1;
+    }
+
+    lineFromFit(&samples->fit, &mInv, &b);
+    residual = fabs(marginX - ((mInv * rowNum) + b));
+    cutoff = 3 * samples->scale;
+    if (cutoff < MIN_OUTLIER_DISTANCE){
+        cutoff = MIN_OUTLIER_DISTANCE;
+    }
+    if (residual > fmax(samples->scale, MIN_OUTLIER_DISTANCE)){
+        samples->rowStatus[rowNum] = 2;
+    }
+    if (residual > cutoff){
+        return 0;
+    }
+    samples->inliers[samples->numPoints - 1] = 1;
+    addPointToFit(&samples->fit, marginX, rowNum);
+    samples->numInliers++;
+    return 1;
+}
+
+//throw away the running fit and robustly refit every point sampled so far, then mark the rows again against the new line
+void refitMargin(MarginSamples *samples){
+    size_t k;
+    double mInv, b, residual;
+
+    samples->numInliers = fitLineRobust(samples->points, samples->numPoints, samples->inliers, &samples->fit, &samples->scale);
+    lineFromFit(&samples->fit, &mInv, &b);
+    for (k = 0; k < samples->numPoints; k++){
+        residual = fabs(samples->points[k].x - ((mInv * samples->points[k].y) + b));
+        samples->rowStatus[samples->points[k].y] = (samples->inliers[k] && residual <= fmax(samples->scale, MIN_OUTLIER_DISTANCE)) ? 1 : 2;
+    }
+}
+
+//find the first black pixel in the left quarter of a row as it would be after dilating NUM_DILATIONS times, or -1 if none
+//dilating is the union of the original and its left, up left, and down left shifts, so after n dilations a pixel is
+//black when some original black pixel is k <= n pixels to its right and at most k rows above or below it
+//that means only the first black pixel of each nearby row matters, and we never need to dilate the whole image
+int findMarginX(Image *self, unsigned int rowNum, int *firstBlack){
+    int d, x, rowX;
+    int result = -1;
+    unsigned int limit = (self->width / 4) + NUM_DILATIONS;
+
+    for (d = -NUM_DILATIONS; d <= NUM_DILATIONS; d++){
+        if ((int)rowNum + d < 0 || rowNum + d >= self->height){
+            continue;
+        }
+
+        //find the first black pixel of the nearby row, if we haven't already
+        if (firstBlack[rowNum + d] == -2){
+            firstBlack[rowNum + d] = firstBlackPixel(self, rowNum + d, limit);
+        }
+        rowX = firstBlack[rowNum + d];
+
+        //it has to be at least |d| pixels in to reach this row diagonally
+        if (rowX < 0 || rowX < abs(d)){
+            continue;
+        }
+        x = rowX - NUM_DILATIONS;
+        if (x < 0){
+            x = 0;
+        }
+        if (result == -1 || x < result){
+            result = x;
+        }
+    }
+
+    if (result >= (int)(self->width / 4)){
+        return -1;
+    }
+    return result;
+}
+
 //rotate an image theta radians about the center of the image
 static void rotate(Image *self, double theta){
-    size_t i, j;
+    size_t j;
+    char *temp;
+
+    //fill a temp buffer with our new pixel data, since we read from the original while rotating
+    temp = malloc(sizeof(char) * self->numBytesPerRow * self->height);
+    for (j = 0; j < self->height; j++){
+        rotateRow(self, theta, j, temp + (j * self->numBytesPerRow));
+    }
+
+    //copy and free the changes
+    memcpy(self->data, temp, self->numBytesPerRow * self->height);
+    free(temp);
+}
+
+//rotate an image theta radians about the center of the image, handing the rotated rows to the sink a band at a time
+//only one band is ever held in memory, and the image itself is left untouched
+//return 1 for success, 0 for failure
+int rotateToSink(Image *self, double theta, RowSink *sink){
+    size_t j, k, numRows;
+    char *band;
+
+    if (!sink->begin(sink, self->width, self->height, self->numBytesPerRow)){
+        return 0;
+    }
+
+    //fill a band, send it off, and reuse it for the next
+    band = malloc(sizeof(char) * self->numBytesPerRow * ROTATE_BAND_ROWS);
+    for (j = 0; j < self->height; j += numRows){
+        numRows = self->height - j;
+        if (numRows > ROTATE_BAND_ROWS){
+            numRows = ROTATE_BAND_ROWS;
+        }
+        for (k = 0; k < numRows; k++){
+            rotateRow(self, theta, j + k, band + (k * self->numBytesPerRow));
+        }
+        if (!sink->writeRows(sink, band, numRows)){
+            free(band);
+            return 0;
+        }
+    }
+    free(band);
+
+    return sink->end(sink);
+}
+
+//fill in a single row of the rotated image - row must be numBytesPerRow long
+static void rotateRow(Image *self, double theta, unsigned int rowNum, char *row){
+    size_t i;
     double centerX = ((double)self->width) / 2;
     double centerY = ((double)self->height) / 2;
+    double cosTheta = cos(-1*theta);
+    double sinTheta = sin(-1*theta);
     double srcX, srcY, x, y;
-    Image temp;
-
-    //create a temp Image to store our new pixel data in
-    temp.width = self->width;
-    temp.height = self->height;
-    temp.numBytesPerRow = self->numBytesPerRow;
-    temp.data = malloc(sizeof(char) * temp.numBytesPerRow * temp.height);
-    
-    //set new pixels in temp
-    for (j = 0; j < self->height; j++){
-        for (i = 0; i < self->width; i++){
-            x = (double)i;
-            y = (double)j;
-            srcX = (x-centerX)*cos(-1*theta) - (y-centerY)*sin(-1*theta) + centerX;
-            srcY = (x-centerX)*sin(-1*theta) + (y-centerY)*cos(-1*theta) + centerY;
-            
-            if (0 <= srcX && srcX < self->width && 0 <= srcY && srcY < self->height){
-                //set(&temp, i, j, get(self, (unsigned int)srcX, (unsigned int)srcY));
-                set(&temp, i, j, getSample(self, srcX, srcY));
-            } else {
-                set(&temp, i, j, 0);
-            }
+
+    //start from blank so we only need to set the black pixels
+    memset(row, 0, self->numBytesPerRow);
+
+    y = (double)rowNum;
+    for (i = 0; i < self->width; i++){
+        x = (double)i;
+        srcX = (x-centerX)*cosTheta - (y-centerY)*sinTheta + centerX;
+        srcY = (x-centerX)*sinTheta + (y-centerY)*cosTheta + centerY;
+
+        if (0 <= srcX && srcX < self->width && 0 <= srcY && srcY < self->height){
+            //row[i / 8] |= get(self, (unsigned int)srcX, (unsigned int)srcY) << (7 - (i % 8));
+            row[i / 8] |= getSample(self, srcX, srcY) << (7 - (i % 8));
         }
     }
-
-    //copy and free the changes
-    memcpy(self->data, temp.data, self->numBytesPerRow * self->height);
-    free(temp.data);
 }
 
 
@@ -445,6 +733,28 @@ int getSample(Image *self, double x, double y){
 }
 
 
+//return the x of the first black pixel in the given row before limit, or -1 if there isn't one
+//whole bytes of white are skipped at once
+int firstBlackPixel(Image *self, unsigned int rowNum, unsigned int limit){
+    size_t i;
+    unsigned int x;
+    unsigned char *row = (unsigned char *)self->data + (self->numBytesPerRow * rowNum);
+
+    if (limit > self->width){
+        limit = self->width;
+    }
+    for (i = 0; i * 8 < limit; i++){
+        if (row[i] != 0){
+            for (x = i * 8; x < limit; x++){
+                if (get(self, x, rowNum)){
+                    return x;
+                }
+            }
+        }
+    }
+    return -1;
+}
+
 //print a subset of the image to the console
 void printBox(Image *self, unsigned int x, unsigned int y, unsigned int width, unsigned int height){
     if (x + width > self->width || y + height > self->height){
@@ -486,36 +796,122 @@ Image *copyBox(Image *self, unsigned int x, unsigned int y, unsigned int width,
     return result;
 }
 
-//return a copy of the image
-Image *copy(Image *self){
-    return copyBox(self, 0, 0, self->width, self->height);
+//return 1 for succses, 0 for failure
+int savePBM(Image *self, const char *filename){
+    return saveWithSink(filename, self, 0, 0, 0);
+}
+
+//save as a plain (P1) PBM - ASCII digits, much bigger than P4 but some tools only read this
+//return 1 for succses, 0 for failure
+int savePlainPBM(Image *self, const char *filename){
+    return saveWithSink(filename, self, 0, 0, 1);
 }
 
+//rotate the image theta radians while writing it out, without ever holding the whole rotated image in memory
+//writes a plain PBM if plain is nonzero, binary otherwise
 //return 1 for succses, 0 for failure
-int savePBM(Image *self, const char *filename){
+int saveRotatedPBM(Image *self, double theta, const char *filename, int plain){
+    return saveWithSink(filename, self, theta, 1, plain);
+}
+
+/////////////////////////////////////////////////
+// Output methods
+/////////////////////////////////////////////////
+
+//open filename and write the image to it through a PBM or plain PBM sink, rotating it on the way if asked
+//return 1 for succses, 0 for failure
+static int saveWithSink(const char *filename, Image *self, double theta, int rotated, int plain){
     int ret;
     FILE *fout;
-   
+    PBMSinkState state;
+    PlainPBMSinkState plainState;
+    RowSink sink;
+
     fout = fopen(filename, "wb");
     if (fout == NULL){
         return 0;
     }
-     
-    //write the header
-    ret = fprintf(fout, "P4\n%d %d\n", self->width, self->height);
-    if (ret < 0){
-        fclose(fout);
-        return 0;
+    if (plain){
+        plainState.fout = fout;
+        sink.begin = writePlainPBMHeader;
+        sink.writeRows = writePlainPBMRows;
+        sink.state = &plainState;
+    } else {
+        state.fout = fout;
+        sink.begin = writePBMHeader;
+        sink.writeRows = writePBMRows;
+        sink.state = &state;
     }
+    sink.end = finishPBM;
 
-    //write the data
-    ret = fwrite(self->data, sizeof(char), self->numBytesPerRow * self->height, fout);
-    if (ret != self->numBytesPerRow * self->height){
-        fclose(fout);
-        return 0;
+    if (rotated){
+        ret = rotateToSink(self, theta, &sink);
+    } else {
+        ret = sink.begin(&sink, self->width, self->height, self->numBytesPerRow)
+            && sink.writeRows(&sink, self->data, self->height)
+            && sink.end(&sink);
     }
 
     fclose(fout);
+    return ret;
+}
+
+//write the P4 header and remember the row size for writePBMRows
+static int writePBMHeader(RowSink *self, unsigned int width, unsigned int height, unsigned int numBytesPerRow){
+    PBMSinkState *state = self->state;
+    state->numBytesPerRow = numBytesPerRow;
+    return fprintf(state->fout, "P4\n%d %d\n", width, height) >= 0;
+}
+
+//the packed rows are already in P4 format, so write them straight out
+static int writePBMRows(RowSink *self, const char *rows, unsigned int numRows){
+    PBMSinkState *state = self->state;
+    size_t len = state->numBytesPerRow * numRows;
+    return fwrite(rows, sizeof(char), len, state->fout) == len;
+}
+
+//nothing is buffered, so there is nothing to finish - the caller closes the file
+//shared by the plain sink as well
+static int finishPBM(RowSink *self){
+    (void)self;
+    return 1;
+}
+
+//write the P1 header and remember the row sizes for writePlainPBMRows
+static int writePlainPBMHeader(RowSink *self, unsigned int width, unsigned int height, unsigned int numBytesPerRow){
+    PlainPBMSinkState *state = self->state;
+    state->width = width;
+    state->numBytesPerRow = numBytesPerRow;
+    return fprintf(state->fout, "P1\n%d %d\n", width, height) >= 0;
+}
+
+//write each row as '0'/'1' characters, breaking lines every PLAIN_PIXELS_PER_LINE pixels to stay under the 70 character limit
+static int writePlainPBMRows(RowSink *self, const char *rows, unsigned int numRows){
+    PlainPBMSinkState *state = self->state;
+    char line[PLAIN_PIXELS_PER_LINE + 1];
+    size_t i, j, lineLength;
+    const char *row;
+
+    for (j = 0; j < numRows; j++){
+        row = rows + (j * state->numBytesPerRow);
+        lineLength = 0;
+        for (i = 0; i < state->width; i += 8){
+            encodePlainByte(row[i / 8], line + lineLength);
+            //the last byte of a row may only be partly used
+            if (state->width - i < 8){
+                lineLength += state->width - i;
+            } else {
+                lineLength += 8;
+            }
+            if (lineLength == PLAIN_PIXELS_PER_LINE || i + 8 >= state->width){
+                line[lineLength] = '\n';
+                if (fwrite(line, sizeof(char), lineLength + 1, state->fout) != lineLength + 1){
+                    return 0;
+                }
+                lineLength = 0;
+            }
+        }
+    }
     return 1;
 }
 
@@ -523,88 +919,274 @@ int savePBM(Image *self, const char *filename){
 // Utility methods
 /////////////////////////////////////////////////
 
-//return the next index in the string str that isn't whitespace, starting start
+//return the next index in the string str that isn't whitespace or part of a comment, starting start
+//comments run from a '#' to the end of the line
 int skipWhitespace(char *str, size_t start){
     size_t curr = start;
-    while (isspace(str[curr])){
-        curr++;
+    while (isspace(str[curr]) || str[curr] == '#'){
+        if (str[curr] == '#'){
+            while (str[curr] != '\n' && str[curr] != '\0'){
+                curr++;
+            }
+        } else {
+            curr++;
+        }
     }
     return curr;
 }
 
-//go through the list of Pairs, compute x in terms of y (since for very straight margins, y in terms of x will have large slope)
-//store resulting slope and x-intercept in given doubles
+//pack the '0'/'1' characters of a plain PBM raster into the already zeroed data of dest
+//whitespace and comments between digits are skipped; return 1 for success, 0 for failure
+//runs of eight digits or eight whitespace characters are handled a 64 bit word at a time
+static int decodePlainRaster(const char *src, size_t length, Image *dest){
+    size_t c = 0;
+    unsigned int x = 0;
+    unsigned int y = 0;
+    unsigned char *row = (unsigned char *)dest->data;
+    unsigned char bits;
+    uint64_t word;
+
+    //nothing to read for an empty image
+    if (dest->width == 0){
+        return 1;
+    }
+
+    while (y < dest->height){
+#if PLAIN_PBM_SWAR
+        if (c + 8 <= length){
+            memcpy(&word, src + c, 8);
+
+            //eight digits in a row - pack them straight into a byte, which may straddle two bytes of the row
+            if ((word & 0xFEFEFEFEFEFEFEFEULL) == 0x3030303030303030ULL && dest->width - x >= 8){
+                bits = ((word & 0x0101010101010101ULL) * 0x8040201008040201ULL) >> 56;
+                row[x / 8] |= bits >> (x % 8);
+                if (x % 8){
+                    row[(x / 8) + 1] |= bits << (8 - (x % 8));
+                }
+                c += 8;
+                x += 8;
+                if (x == dest->width){
+                    x = 0;
+                    y++;
+                    row += dest->numBytesPerRow;
+                }
+                continue;
+            }
+
+            //eight whitespace characters (the same ones isspace takes below) - skip them all
+            if ((matchingBytes(word, ' ') | matchingBytes(word, '\t') | matchingBytes(word, '\n')
+                    | matchingBytes(word, '\v') | matchingBytes(word, '\f') | matchingBytes(word, '\r'))
+                    == 0x8080808080808080ULL){
+                c += 8;
+                continue;
+            }
+        }
+#endif
+
+        //otherwise go one character at a time
+        if (c >= length){
+            break;
+        }
+        if (src[c] == '0' || src[c] == '1'){
+            row[x / 8] |= (src[c] - '0') << (7 - (x % 8));
+            x++;
+            if (x == dest->width){
+                x = 0;
+                y++;
+                row += dest->numBytesPerRow;
+            }
+            c++;
+        } else if (src[c] == '#'){
+            while (c < length && src[c] != '\n'){
+                c++;
+            }
+        } else if (isspace(src[c])){
+            c++;
+        } else {
+            fprintf(stderr, "Bad raster\n");
+            return 0;
+        }
+    }
+
+    if (y < dest->height){
+        fprintf(stderr, "Raster too short\n");
+        return 0;
+    }
+    return 1;
+}
+
+//write the 8 pixels of byte as '0'/'1' characters to dest
+static void encodePlainByte(unsigned char byte, char *dest){
+#if PLAIN_PBM_SWAR
+    //copy the byte to every lane, keep one bit per lane (msb first), then turn each lane into '0' or '1'
+    uint64_t word = byte * 0x0101010101010101ULL;
+    word &= 0x0102040810204080ULL;
+    word = ((word + 0x7F7F7F7F7F7F7F7FULL) >> 7) & 0x0101010101010101ULL;
+    word |= 0x3030303030303030ULL;
+    memcpy(dest, &word, 8);
+#else
+    int i;
+    for (i = 0; i < 8; i++){
+        dest[i] = '0' + ((byte >> (7 - i)) & 1);
+    }
+#endif
+}
+
+//return a word with the high bit set in each byte of word equal to value, and every other bit clear
+//the low 7 bits of a byte are added to 0x7F so that no carry crosses into the next byte
+static uint64_t matchingBytes(uint64_t word, unsigned char value){
+    uint64_t diff = word ^ (value * 0x0101010101010101ULL);
+    return ~(((diff & 0x7F7F7F7F7F7F7F7FULL) + 0x7F7F7F7F7F7F7F7FULL) | diff) & 0x8080808080808080ULL;
+}
+
+//add a point to a running line fit of x in terms of y (since for very straight margins, y in terms of x will have large slope)
+//the means and sums of squares are updated in place, so rows can be added one at a time as they are sampled
+//thanks to: https://en.wikipedia.org/wiki/Algorithms_for_calculating_variance#Welford's_online_algorithm
+static void addPointToFit(LineFit *fit, double x, double y){
+    double dx, dy;
+
+    fit->n++;
+    dx = x - fit->meanX;
+    dy = y - fit->meanY;
+    fit->meanX += dx / fit->n;
+    fit->meanY += dy / fit->n;
+    fit->sumSquaresX += dx * (x - fit->meanX);
+    fit->sumSquaresY += dy * (y - fit->meanY);
+    fit->sumProducts += dx * (y - fit->meanY);
+}
+
+//store the slope and x intercept (remember, x in terms of y) of the fit in the given doubles
 //thanks to: http://www.varsitytutors.com/hotmath/hotmath_help/topics/line-of-best-fit
-static int fitLineToPoints(Pair *points, size_t numPoints, double *mInvResult, double *bResult){
-    size_t i;
-    double xAvg, yAvg;
-    double sumNumerator, sumDenominator;
-   
+static void lineFromFit(LineFit *fit, double *mInvResult, double *bResult){
     //safety first
-    if (numPoints < 2){
+    if (fit->n < 2 || fit->sumSquaresY == 0){
         *mInvResult = 1;
         *bResult = 0;
         return;
     }
- 
-    //compute averages
-    xAvg = 0.0;
-    yAvg = 0.0;
-    for (i = 0; i < numPoints; i++){
-        xAvg = (xAvg * (((float)i) / (i + 1))) + (((double) points[i].x) / (i + 1));
-        yAvg = (yAvg * (((float)i) / (i + 1))) + (((double) points[i].y) / (i + 1));
-    }
 
-    //find slope and x intercept (remember, x in terms of y)
-    sumNumerator = 0.0;
-    sumDenominator = 0.0;
-    for (i = 0; i < numPoints; i++){
-        sumNumerator += (points[i].y - yAvg) * (points[i].x - xAvg);
-        sumDenominator += (points[i].y - yAvg) * (points[i].y - yAvg);
+    *mInvResult = fit->sumProducts / fit->sumSquaresY;
+    *bResult = fit->meanX - ((*mInvResult) * fit->meanY);
+}
+
+//return the standard deviation of the points' x distances from the fit line, or 0 if there aren't enough points
+static double residualScaleFromFit(LineFit *fit){
+    double mInv, sumSquareResiduals;
+
+    //need at least three points to say anything about the spread
+    if (fit->n < 3 || fit->sumSquaresY == 0){
+        return 0;
     }
 
-    //store and return
-    *mInvResult = sumNumerator / sumDenominator;
-    *bResult = xAvg - ((*mInvResult) * yAvg);
-    return 0;
+    //the residuals are whatever spread in x the slope doesn't explain
+    mInv = fit->sumProducts / fit->sumSquaresY;
+    sumSquareResiduals = fit->sumSquaresX - (mInv * fit->sumProducts);
+    if (sumSquareResiduals < 0){
+        sumSquareResiduals = 0;
+    }
+    return sqrt(sumSquareResiduals / (fit->n - 2));
 }
 
-//computes the average over the x-values and removes in place anything beyond 1/4th a std dev; returns new length
-//thanks to: http://codeselfstudy.com/blogs/how-to-calculate-standard-deviation-in-python
-size_t removeXOutliers(Pair *points, size_t len){
-    double mean, sumSquareDifferences, stdDev;
-    size_t i;
+//estimate how far off the angle of the fit line could be, in radians
+//this is the half width of a 95% confidence interval on the slope, carried through atan
+//thanks to: https://en.wikipedia.org/wiki/Simple_linear_regression#Confidence_intervals
+static double angleErrorFromFit(LineFit *fit){
+    double mInv, slopeError;
 
-    //compute the average
-    for (i = 0; i < len; i++){
-        mean = (mean * (((float)i) / (i + 1))) + (((double) points[i].x) / (i + 1));
+    if (fit->n < 3 || fit->sumSquaresY == 0){
+        return M_PI / 2;
     }
 
-    //compute the sum of the squares of the differences, then the std dev.
-    sumSquareDifferences = 0.0;
-    for (i = 0; i < len; i++){
-        sumSquareDifferences += (((double)points[i].x) - mean) * (((double)points[i].x) - mean);
+    //standard error of the slope, and then d(atan(m))/dm = 1/(1+m^2)
+    mInv = fit->sumProducts / fit->sumSquaresY;
+    slopeError = residualScaleFromFit(fit) / sqrt(fit->sumSquaresY);
+    return (1.96 * slopeError) / (1 + (mInv * mInv));
+}
+
+//fit a line in terms of y to the points, repeatedly throwing out points too far from the line and refitting
+//too far is measured with the median absolute deviation of the distances, so a few bad points can't drag the cutoff
+//this sorts and refits every pass, so it only runs on the first coarse sample and when the running fit looks bad
+//inliers is set to 1 for points kept and 0 for outliers; returns the number kept
+//the fit of the kept points and the typical distance of a point from the line are stored in fitResult and scaleResult
+//thanks to: https://en.wikipedia.org/wiki/Median_absolute_deviation
+static size_t fitLineRobust(Pair *points, size_t numPoints, char *inliers, LineFit *fitResult, double *scaleResult){
+    size_t i, numInliers;
+    int iteration, changed;
+    double center, cutoff;
+    double mInv = 0;
+    double b = 0;
+    double *residuals = malloc(sizeof(double) * (numPoints + 1));
+    double *deviations = malloc(sizeof(double) * (numPoints + 1));
+
+    //start from a vertical line, so the first pass is just outliers in x
+    numInliers = numPoints;
+    for (i = 0; i < numPoints; i++){
+        inliers[i] = 1;
     }
-    stdDev = sqrt(sumSquareDifferences / len);
+    *scaleResult = 0;
+    for (iteration = 0; iteration < ROBUST_FIT_ITERATIONS && numPoints > 0; iteration++){
+        //how far each point is from the line, and the median and median absolute deviation of that
+        for (i = 0; i < numPoints; i++){
+            residuals[i] = points[i].x - ((mInv * points[i].y) + b);
+            deviations[i] = residuals[i];
+        }
+        center = median(deviations, numPoints);
+        for (i = 0; i < numPoints; i++){
+            deviations[i] = fabs(residuals[i] - center);
+        }
+        *scaleResult = 1.4826 * median(deviations, numPoints);
 
-    //copy over points within 1/4th a std dev
-    //double lowerBound = mean - (stdDev / 4);
-    //double upperBound = mean + (stdDev / 4);
-    double lowerBound = mean - (stdDev);
-    double upperBound = mean + (stdDev);
-    size_t newLength = 0;
-    Pair *newPoints = malloc(sizeof(Pair) * len);
-    for (i = 0; i < len; i++){
-        if (lowerBound <= points[i].x && points[i].x <= upperBound){
-            newPoints[newLength] = points[i];
-            newLength++;
+        //keep points within 3 deviations of the center
+        cutoff = 3 * (*scaleResult);
+        if (cutoff < MIN_OUTLIER_DISTANCE){
+            cutoff = MIN_OUTLIER_DISTANCE;
         }
+        changed = 0;
+        numInliers = 0;
+        memset(fitResult, 0, sizeof(LineFit));
+        for (i = 0; i < numPoints; i++){
+            if (inliers[i] != (fabs(residuals[i] - center) <= cutoff)){
+                inliers[i] = !inliers[i];
+                changed = 1;
+            }
+            if (inliers[i]){
+                addPointToFit(fitResult, points[i].x, points[i].y);
+                numInliers++;
+            }
+        }
+        lineFromFit(fitResult, &mInv, &b);
+
+        //no point refitting the same points
+        if (!changed && iteration > 0){
+            break;
+        }
+    }
+    if (numPoints == 0){
+        memset(fitResult, 0, sizeof(LineFit));
     }
 
-    //copy, free, and return
-    memcpy(points, newPoints, sizeof(Pair) * newLength);
-    free(newPoints);
-    return newLength;
+    free(residuals);
+    free(deviations);
+    return numInliers;
+}
+
+//return the median of the values, which are sorted in place
+static double median(double *values, size_t len){
+    if (len == 0){
+        return 0;
+    }
+    qsort(values, len, sizeof(double), compareDoubles);
+    if (len % 2){
+        return values[len / 2];
+    }
+    return (values[(len / 2) - 1] + values[len / 2]) / 2;
+}
+
+//comparison function for sorting doubles with qsort
+static int compareDoubles(const void *a, const void *b){
+    double first = *(const double *)a;
+    double second = *(const double *)b;
+    return (first > second) - (first < second);
 }
 
 //shift the given array of image data to the left one bit
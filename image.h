@@ -10,8 +10,31 @@ typedef struct Image {
     char *data;
 } Image;
 
+typedef struct PageInfo {
+    unsigned int cropX;
+    unsigned int cropWidth;
+    double angle;
+    double angleError;
+    size_t numSampledRows;
+    size_t numMarginPoints;
+    size_t numInlierPoints;
+    double marginScale;
+} PageInfo;
+
+typedef struct RowSink {
+    int (*begin)(struct RowSink *self, unsigned int width, unsigned int height, unsigned int numBytesPerRow);
+    int (*writeRows)(struct RowSink *self, const char *rows, unsigned int numRows);
+    int (*end)(struct RowSink *self);
+    void *state;
+} RowSink;
+
 Image *createImage(char *pbmContents, size_t len);
 int correctImage(Image *self, Image **lResult, Image **rResult);
+int analyzeImage(Image *self, PageInfo *lResult, PageInfo *rResult);
+int splitImage(Image *self, Image **lResult, Image **rResult, PageInfo *lInfo, PageInfo *rInfo);
+int rotateToSink(Image *self, double theta, RowSink *sink);
 int savePBM(Image *self, const char *filename);
+int savePlainPBM(Image *self, const char *filename);
+int saveRotatedPBM(Image *self, double theta, const char *filename, int plain);
 
 #endif
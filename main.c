@@ -2,19 +2,46 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <math.h>
+#include <time.h>
+
+//M_PI is a POSIX extension, not ISO C
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
 
 static char *readFileToString(const char *filename, size_t *length);
+static int analyzeFiles(char **filenames, int numFiles, int json);
+static void printPageCSV(const char *filename, const char *page, PageInfo *info);
+static void printPageJSON(const char *filename, const char *page, PageInfo *info);
+static int benchmarkDecode(char **filenames, int numFiles);
+static double inlierRatio(PageInfo *info);
 static void printUsage();
 static void printHelp();
 
 int main(int argc, char **argv){
     int ret = 0;
+    int plain = 0;
 
     //parse arguments
     if (argc == 2 && !strcmp(argv[1], "-h")){
         printHelp();
         return 0;
-    } else if (argc == 1 || argc > 3){
+    } else if (argc > 2 && !strcmp(argv[1], "-a")){
+        return analyzeFiles(argv + 2, argc - 2, 0);
+    } else if (argc > 2 && !strcmp(argv[1], "-j")){
+        return analyzeFiles(argv + 2, argc - 2, 1);
+    } else if (argc > 2 && !strcmp(argv[1], "-b")){
+        return benchmarkDecode(argv + 2, argc - 2);
+    }
+
+    //plain output comes before the usual arguments
+    if (argc > 1 && !strcmp(argv[1], "-p")){
+        plain = 1;
+        argc--;
+        argv++;
+    }
+    if (argc == 1 || argc > 3){
         printUsage();
         return 1;
     }
@@ -28,10 +55,17 @@ int main(int argc, char **argv){
     }
     Image *im = createImage(data, length);
     free(data);
+    if (im == NULL){
+        printf("Problem parsing file\n");
+        return 1;
+    }
 
-    //do the processing on the images
+    //split and measure the pages - the rotation happens as they are saved, so the original isn't needed after this
     Image *left, *right;
-    correctImage(im, &left, &right);
+    PageInfo leftInfo, rightInfo;
+    splitImage(im, &left, &right, &leftInfo, &rightInfo);
+    free(im->data);
+    free(im);
 
     //save the files out - allocate for directory, name, "-l" and "-r" suffix, delimiter, and null character
     size_t position;
@@ -50,12 +84,12 @@ int main(int argc, char **argv){
         position = strlen(argv[1]) - 4;
     }
     strcpy(outputName + position, "-l.pbm");
-    if (!savePBM(left, outputName)){
+    if (!saveRotatedPBM(left, leftInfo.angle, outputName, plain)){
         printf("Problem saving %s\n", outputName);
         ret = 1;
     }
     strcpy(outputName + position, "-r.pbm");
-    if (!savePBM(right, outputName)){
+    if (!saveRotatedPBM(right, rightInfo.angle, outputName, plain)){
         printf("Problem saving %s\n", outputName);
         ret = 1;
     }
@@ -63,10 +97,8 @@ int main(int argc, char **argv){
     //free stuff
     free(left->data);
     free(right->data);
-    free(im->data);
     free(left);
     free(right);
-    free(im);
     free(outputName);
 
     return ret;
@@ -98,11 +130,164 @@ char *readFileToString(const char *filename, size_t *length){
     return data;
 }
 
+//measure each file without rotating or saving anything, and print the results to stdout as CSV or JSON
+//returns 0 if every file could be analyzed, 1 otherwise
+int analyzeFiles(char **filenames, int numFiles, int json){
+    int ret = 0;
+    int first = 1;
+    int i;
+    size_t length;
+    char *data;
+    Image *im;
+    PageInfo left, right;
+
+    if (json){
+        printf("[");
+    } else {
+        printf("file,page,crop_x,crop_width,angle_deg,angle_error_deg,sampled_rows,margin_points,inlier_points,inlier_ratio,margin_scale_px\n");
+    }
+
+    for (i = 0; i < numFiles; i++){
+        //read in from file, skipping anything we can't use
+        data = readFileToString(filenames[i], &length);
+        if (data == NULL){
+            fprintf(stderr, "Problem reading %s\n", filenames[i]);
+            ret = 1;
+            continue;
+        }
+        im = createImage(data, length);
+        free(data);
+        if (im == NULL){
+            fprintf(stderr, "Problem parsing %s\n", filenames[i]);
+            ret = 1;
+            continue;
+        }
+
+        //measure and print both pages
+        analyzeImage(im, &left, &right);
+        if (json){
+            printf(first ? "\n" : ",\n");
+            printPageJSON(filenames[i], "left", &left);
+            printf(",\n");
+            printPageJSON(filenames[i], "right", &right);
+        } else {
+            printPageCSV(filenames[i], "left", &left);
+            printPageCSV(filenames[i], "right", &right);
+        }
+        first = 0;
+
+        free(im->data);
+        free(im);
+    }
+
+    if (json){
+        printf("\n]\n");
+    }
+    return ret;
+}
+
+//print one page's measurements as a CSV row, quoting the filename
+void printPageCSV(const char *filename, const char *page, PageInfo *info){
+    const char *c;
+
+    printf("\"");
+    for (c = filename; *c != '\0'; c++){
+        if (*c == '"'){
+            printf("\"");
+        }
+        printf("%c", *c);
+    }
+    printf("\",%s,%u,%u,%f,%f,%lu,%lu,%lu,%f,%f\n", page, info->cropX, info->cropWidth,
+            info->angle * 180 / M_PI, info->angleError * 180 / M_PI, (unsigned long)info->numSampledRows,
+            (unsigned long)info->numMarginPoints, (unsigned long)info->numInlierPoints,
+            inlierRatio(info), info->marginScale);
+}
+
+//print one page's measurements as a JSON object, escaping the filename
+void printPageJSON(const char *filename, const char *page, PageInfo *info){
+    const char *c;
+
+    printf("  {\"file\": \"");
+    for (c = filename; *c != '\0'; c++){
+        if (*c == '"' || *c == '\\'){
+            printf("\\%c", *c);
+        } else if ((unsigned char)*c < 0x20){
+            printf("\\u%04x", *c);
+        } else {
+            printf("%c", *c);
+        }
+    }
+    printf("\", \"page\": \"%s\", \"crop_x\": %u, \"crop_width\": %u, \"angle_deg\": %f, \"angle_error_deg\": %f, \"sampled_rows\": %lu, \"margin_points\": %lu, \"inlier_points\": %lu, \"inlier_ratio\": %f, \"margin_scale_px\": %f}",
+            page, info->cropX, info->cropWidth,
+            info->angle * 180 / M_PI, info->angleError * 180 / M_PI, (unsigned long)info->numSampledRows,
+            (unsigned long)info->numMarginPoints, (unsigned long)info->numInlierPoints,
+            inlierRatio(info), info->marginScale);
+}
+
+//the share of margin points that made it into the fit, or 0 if there were none
+double inlierRatio(PageInfo *info){
+    if (info->numMarginPoints == 0){
+        return 0;
+    }
+    return ((double)info->numInlierPoints) / info->numMarginPoints;
+}
+
+//time how fast each file can be parsed, repeating for at least a second, and print the throughput to stdout
+//returns 0 if every file could be parsed, 1 otherwise
+int benchmarkDecode(char **filenames, int numFiles){
+    int ret = 0;
+    int i, runs;
+    size_t length;
+    char *data;
+    Image *im;
+    clock_t start;
+    double seconds;
+
+    for (i = 0; i < numFiles; i++){
+        data = readFileToString(filenames[i], &length);
+        if (data == NULL){
+            fprintf(stderr, "Problem reading %s\n", filenames[i]);
+            ret = 1;
+            continue;
+        }
+
+        //keep parsing until enough time has gone by to trust the clock
+        runs = 0;
+        seconds = 0;
+        start = clock();
+        while (seconds < 1.0){
+            im = createImage(data, length);
+            if (im == NULL){
+                break;
+            }
+            free(im->data);
+            free(im);
+            runs++;
+            seconds = ((double)(clock() - start)) / CLOCKS_PER_SEC;
+        }
+        free(data);
+        if (runs == 0){
+            fprintf(stderr, "Problem parsing %s\n", filenames[i]);
+            ret = 1;
+            continue;
+        }
+
+        printf("%s: %.1f MB/s (%d runs of %lu bytes)\n", filenames[i],
+                (((double)length) * runs) / (seconds * 1000000), runs, (unsigned long)length);
+    }
+
+    return ret;
+}
+
 void printUsage(){
-    printf("Usage:\n\tpbmcorrect <input file> [output directory]\n");
+    printf("Usage:\n\tpbmcorrect [-p] <input file> [output directory]\n\tpbmcorrect -a|-j <input file>...\n\tpbmcorrect -b <input file>...\n");
 }
 
 void printHelp(){
     printUsage();
-    printf("Process the input PBM file into two PBM files in the output directory that are\nthe left and right page of the original file, rotated and centered.");
+    printf("Process the input PBM file into two PBM files in the output directory that are\nthe left and right page of the original file, rotated and centered.\n");
+    printf("\nWith -a or -j, only measure the input PBM files and print the crop, rotation angle,\nand margin fit of each page as CSV or JSON, without rotating or saving anything.\n");
+    printf("A low inlier ratio or a margin scale of more than a few pixels means the margin was\ntoo cluttered to trust the angle.\n");
+    printf("\nInput may be binary (P4) or plain (P1) PBM. With -p, the output files are plain PBM.\n");
+    printf("\nWith -b, time how fast the input PBM files are parsed and print the throughput.\n");
 }